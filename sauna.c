@@ -10,8 +10,14 @@
 #include <errno.h>
 #include <ctype.h>
 #include <sys/syscall.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdatomic.h>
 #include <linux/perf_event.h>
 
+#include "writer.h"
+
 #if NVIDIA
 #include <nvml.h>
 #endif
@@ -28,8 +34,18 @@
 useconds_t interval = 500000;
 /* Maximum number of cores in a machine */
 #define MAX_CORES	256
+/* Interval between summaries of the flight recorder, in microseconds */
+#define SUMMARY_INTERVAL	1000000
+/* Mount point of the unified (v2) cgroup hierarchy */
+#define CGROUP_ROOT	"/sys/fs/cgroup"
 /* END CONFGURATION */
 
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+/* Values of the long options that have no short form, beyond any character */
+#define OPTION_CGROUP	256
+
 #if NVIDIA
 /* Flag to know if the NVIDIA API has been initialized */
 int nvml_up = 0;
@@ -51,6 +67,8 @@ struct mic_device *mdh;
 #endif
 /* The last time a measurement was made. Needed to convert energy to power in RAPL measurements */
 struct timeval last_time;
+/* Time of the previous sample, in seconds since last_time */
+double last_sample = 0;
 /* Number of cores detected in the machine */
 int core_count = 2;
 int query_cores[] = {0,6};
@@ -63,6 +81,10 @@ char rapl_domain_names[NUM_RAPL_DOMAINS][30]= {
 	"pkg",
 	"ram",
 };
+/* Index of the package and memory domains, used to apportion energy to a
+ * cgroup and to work units */
+#define RAPL_PKG	2
+#define RAPL_RAM	3
 /* File descriptors to read the RAPL counters */
 int fd[MAX_CORES][NUM_RAPL_DOMAINS];
 /* Energy at the begining of the ROI */
@@ -74,6 +96,45 @@ double scale[NUM_RAPL_DOMAINS];
 /* File desctiptor for output file */
 FILE *out;
 
+/* Pid of the running process monitored with -p, and its pidfd */
+pid_t attach_pid = 0;
+int attach_pidfd = -1;
+/* Flag set by SIGINT or SIGTERM to stop monitoring a process or cgroup,
+ * and the signal mask that lets them through while waiting */
+volatile sig_atomic_t interrupted = 0;
+sigset_t wait_mask;
+/* Path of the cgroup monitored with --cgroup */
+char *cgroup_path = NULL;
+/* File descriptors to cgroup.events and cpu.stat of the monitored cgroup,
+ * and to cpu.stat of the root cgroup */
+int cgroup_events_fd = -1;
+int cgroup_stat_fd = -1;
+int root_stat_fd = -1;
+/* Last CPU time (usec) consumed by the monitored cgroup and the whole machine */
+long long last_cgroup_usage;
+long long last_root_usage;
+/* Cumulative package energy apportioned to the monitored cgroup */
+double cgroup_energy;
+
+/* Flag to know if work units reported by the command are being counted */
+int count_work = 0;
+/* Work units reported so far with "++WORK <n>". Only the reader of the
+ * command output adds to it, but the sampler reads it at any time. */
+atomic_llong work_units;
+/* Work units at the start of the measurements and at the last sample */
+long long first_work;
+long long last_work;
+
+/* Flag to know if the flight recorder is on */
+int flight = 0;
+/* Power of the node above which the flight recorder is triggered, 0 for never */
+double trigger_power = 0;
+/* Trigger raised outside the sampler, to be recorded with the next sample */
+atomic_int pending_trigger;
+/* Flag to mark the ROI in the output, set with -r, and whether it is open */
+int mark_roi = 0;
+int roi_open = 0;
+
 /* Functions */
 void usage(int argc, char **argv);
 void help(int argc, char **argv);
@@ -81,26 +142,46 @@ void help(int argc, char **argv);
 #if NVIDIA
 int list_nvidia_devices(nvmlDevice_t *device_list, unsigned int *device_count);
 void reset_nvml();
-void query_nvml_device_power(int device, long long delta);
+double query_nvml_device_power(int device, long long delta);
 void query_nvml_device_energy(int device);
 #endif
 
 #if XEONPHI
 int init_mic();
 void reset_mic();
-void query_mic_device_power(long long delta);
+double query_mic_device_power(long long delta);
 void query_mic_device_energy();
 int close_mic();
 void print_mic_error(const char *msg, const char *device_name);
 #endif
 
+int init_cgroup(const char *path);
+void reset_cgroup();
+long long read_cpu_usage(int stat_fd);
+int cgroup_populated();
+void query_cgroup_power(double pkg_power, long long delta);
+void query_cgroup_energy();
+void close_cgroup();
+long parse_work(const char *p);
+void reset_work();
+void query_work_rate(double power, double delta);
+void query_work_total(double energy, double elapsed);
+int wait_pid_exit();
+int wait_cgroup_empty();
+void interrupt_handler (int signo);
+
 void close_and_exit();
 void alarm_handler (int signo);
+void usr1_handler (int signo);
+void record_trigger(int reason, double now);
+void record_roi(int kind, double now);
+void start_measurements();
+void stop_measurements(int reason);
 void print_total_energy();
 int init_rapl_perf();
 void reset_rapl_perf();
-void query_rapl_device_power(int core,long long delta);
-void query_rapl_device_energy(int core);
+double query_rapl_device_power(int core,long long delta,double *node_power);
+double query_rapl_device_energy(int core);
 void close_rapl_perf();
 
 int main(int argc, char **argv)
@@ -113,6 +194,14 @@ int main(int argc, char **argv)
    int flag_roi = 0;
    /* Flag to force output of total energy and time */
    int flag_total = 0;
+   /* Format of the output file */
+   int format = FORMAT_TEXT;
+   /* Compressed file to convert back to text */
+   FILE *decode_in;
+   /* Length of the flight recorder window in seconds */
+   double window = 0;
+   /* Signals that stop monitoring a process or cgroup */
+   sigset_t stop_signals;
 
    /* Pid of child and return status */
    pid_t child_id;
@@ -127,6 +216,8 @@ int main(int argc, char **argv)
    char *line = NULL;
    size_t len = 0;
    ssize_t read;
+   /* Position of a marker in the line */
+   char *marker;
 #if NVIDIA
    /* Return value of NVIDIA API */
    nvmlReturn_t result;
@@ -137,10 +228,16 @@ int main(int argc, char **argv)
    /* Set default output file */
    out = stderr;
 
+   /* Long options, for those without a natural single letter */
+   static struct option long_options[] = {
+      {"cgroup", required_argument, NULL, OPTION_CGROUP},
+      {NULL, 0, NULL, 0}
+   };
+
    /* Disable getopt error reporting */
    opterr = 0;
    /* Process options with getopt */
-   while ((c = getopt (argc, argv, "o::c::r::h::v::i::t::")) != -1)
+   while ((c = getopt_long (argc, argv, "o::c::r::h::v::i::t::w::z::j::d::f::P::p:", long_options, NULL)) != -1)
       switch (c) {
          case 'o':
             if((out = fopen(optarg,"w")) == NULL) {
@@ -150,10 +247,29 @@ int main(int argc, char **argv)
             break;
          case 'r':
             flag_roi = 1;
+            mark_roi = 1;
             break;
          case 't':
             flag_total = 1;
             break;
+         case 'w':
+            count_work = 1;
+            break;
+         case 'z':
+            format = FORMAT_COMPRESSED;
+            break;
+         case 'j':
+            format = FORMAT_TRACE;
+            break;
+         case 'd':
+            if(!optarg || (decode_in = fopen(optarg,"r")) == NULL) {
+               fprintf(stderr,"Could not open compressed file %s for reading. %s\n", optarg?optarg:"(null)", strerror(errno));
+               close_and_exit(EXIT_FAILURE);
+            }
+            if(writer_decode(decode_in, stdout) < 0)
+               close_and_exit(EXIT_FAILURE);
+            fclose(decode_in);
+            close_and_exit(0);
 /*         case 'c':
             endp = NULL;
             l = -1;
@@ -176,6 +292,33 @@ int main(int argc, char **argv)
             }
             interval = l*1000;
             break;
+         case 'f':
+            endp = NULL;
+            if (!optarg || (window=strtod(optarg, &endp)) <= 0 || *endp) {
+               fprintf(stderr,"Invalid window %s - expecting a number of seconds.\n", optarg?optarg:"(null)");
+               close_and_exit(EXIT_FAILURE);
+            }
+            flight = 1;
+            break;
+         case 'P':
+            endp = NULL;
+            if (!optarg || (trigger_power=strtod(optarg, &endp)) <= 0 || *endp) {
+               fprintf(stderr,"Invalid power %s - expecting a number of watts.\n", optarg?optarg:"(null)");
+               close_and_exit(EXIT_FAILURE);
+            }
+            break;
+         case 'p':
+            endp = NULL;
+            l = -1;
+            if ((l=strtol(optarg, &endp, 10)), (*endp || l <= 0)) {
+               fprintf(stderr,"Invalid pid %s - expecting a positive number.\n", optarg);
+               close_and_exit(EXIT_FAILURE);
+            }
+            attach_pid = l;
+            break;
+         case OPTION_CGROUP:
+            cgroup_path = optarg;
+            break;
          case 'v':
             fprintf(stderr,"sauna %s\n",VERSION);
             close_and_exit(0);
@@ -192,29 +335,79 @@ int main(int argc, char **argv)
             close_and_exit (0);
       }
   
-   /* Ensure that the number of arguments is correct. */
-   if(optind == argc) {
+   /* Ensure that the number of arguments is correct. A command can not be
+    * combined with attaching to a running process or cgroup. */
+   if(attach_pid && cgroup_path) {
+      printf ("Error: -p and --cgroup are mutually exclusive.\n");
+      usage(argc, argv);
+      close_and_exit (0);
+   }
+   if(attach_pid || cgroup_path) {
+      if(optind != argc) {
+         printf ("Error: No command can be given when attaching to a %s.\n", attach_pid ? "process" : "cgroup");
+         usage(argc, argv);
+         close_and_exit (0);
+      }
+      if(flag_roi || count_work) {
+         printf ("Error: -%c requires a command whose output can be scanned for markers.\n", flag_roi ? 'r' : 'w');
+         close_and_exit (0);
+      }
+   }
+   else if(optind == argc) {
       printf ("Error: Insufficient arguments.\n");
       usage(argc, argv);
       close_and_exit (0);
    }
-
-   /* Prepare a NULL terminated array of strings to pass to execv, after the fork. */
-   for(i = optind, j = 0; i < argc; i++, j++) {
-      exec_args[j] = argv[i];
+   if(trigger_power && ! flight) {
+      printf ("Error: -P requires the flight recorder, enabled with -f.\n");
+      close_and_exit (0);
+   }
+   if(flight && interval == 0) {
+      printf ("Error: -f requires an interval of at least 1 ms.\n");
+      close_and_exit (0);
+   }
+   /* Keep at least one sample, however short the window */
+   if(flight && writer_flight(window*1e6 > interval ? window*1e6/interval : 1,
+            SUMMARY_INTERVAL > interval ? SUMMARY_INTERVAL/interval : 1) < 0) {
+      printf ("Error: Failed to start the flight recorder.\n");
+      close_and_exit (0);
+   }
+   if(format != FORMAT_TEXT && out == stderr) {
+      printf ("Error: -%c requires an output file set with -o.\n", format == FORMAT_COMPRESSED ? 'z' : 'j');
+      close_and_exit (0);
    }
-   exec_args[j] = NULL;
 
-   /* Prepare communication channel with the child process. */
-   if(pipe(pipe_stdout) < 0) {
-      printf ("Error: could not open pipe.\n");
-      close_and_exit(0);
+   if(attach_pid) {
+      /* Get a file descriptor that becomes readable when the process exits. */
+      if((attach_pidfd = syscall(__NR_pidfd_open, attach_pid, 0)) < 0) {
+         printf ("Error: could not attach to process %d. %s\n", attach_pid, strerror(errno));
+         close_and_exit(0);
+      }
    }
-   
-   /* Create a file descriptor to the reading end of the pipe. */
-   if((child_stdout = fdopen(pipe_stdout[0], "r")) == NULL) {
-      printf ("Error: could create file descriptor to pipe.\n");
-      close_and_exit(0);
+   else if(cgroup_path) {
+      if(init_cgroup(cgroup_path) < 0) {
+         printf ("Error: Failed to attach to cgroup %s.\n", cgroup_path);
+         close_and_exit(0);
+      }
+   }
+   else {
+      /* Prepare a NULL terminated array of strings to pass to execv, after the fork. */
+      for(i = optind, j = 0; i < argc; i++, j++) {
+         exec_args[j] = argv[i];
+      }
+      exec_args[j] = NULL;
+
+      /* Prepare communication channel with the child process. */
+      if(pipe(pipe_stdout) < 0) {
+         printf ("Error: could not open pipe.\n");
+         close_and_exit(0);
+      }
+
+      /* Create a file descriptor to the reading end of the pipe. */
+      if((child_stdout = fdopen(pipe_stdout[0], "r")) == NULL) {
+         printf ("Error: could create file descriptor to pipe.\n");
+         close_and_exit(0);
+      }
    }
 
 #if NVIDIA
@@ -246,82 +439,109 @@ int main(int argc, char **argv)
    }
 #endif
 
-   /* Fork child process */
-   if((child_id = fork()) < 0) {
-      printf ("Error: unable to fork child process.\n");
-      close_and_exit (0);
-   }
-
-   if(child_id == 0) {
-      /* Connect stdout of child process to pipe. */
-      close(pipe_stdout[0]); 
-      if(dup2(pipe_stdout[1],1) < 0) {
-         printf ("Error: failed to duplicate file descriptor in child process.\n");
-         close_and_exit(1);
+   if(! attach_pid && ! cgroup_path) {
+      /* Fork child process */
+      if((child_id = fork()) < 0) {
+         printf ("Error: unable to fork child process.\n");
+         close_and_exit (0);
       }
 
-      /* The child process is replaced by the program supplied by the user. */
-      if(execvp(exec_args[0],exec_args) == -1) {
-         printf ("Error: failed to exec \"%s\" in child process. %s\n",exec_args[0],strerror(errno));
-/*         for(i = 0; exec_args[i] != NULL; i++) 
-              fprintf(stderr,"%s%s",exec_args[i],exec_args[i+1] != NULL ? " ": "");
-           fprintf(stderr,"\n");
-          */
+      if(child_id == 0) {
+         /* Connect stdout of child process to pipe. */
+         close(pipe_stdout[0]); 
+         if(dup2(pipe_stdout[1],1) < 0) {
+            printf ("Error: failed to duplicate file descriptor in child process.\n");
+            close_and_exit(1);
+         }
+
+         /* The child process is replaced by the program supplied by the user. */
+         if(execvp(exec_args[0],exec_args) == -1) {
+            printf ("Error: failed to exec \"%s\" in child process. %s\n",exec_args[0],strerror(errno));
+/*            for(i = 0; exec_args[i] != NULL; i++) 
+                 fprintf(stderr,"%s%s",exec_args[i],exec_args[i+1] != NULL ? " ": "");
+              fprintf(stderr,"\n");
+             */
+         }
+         close_and_exit(1);
       }
-      close_and_exit(1);
+      close(pipe_stdout[1]); 
    }
 
    signal (SIGALRM, alarm_handler);
-   close(pipe_stdout[1]); 
+   if(flight)
+      signal (SIGUSR1, usr1_handler);
    
-   /* Print headers */
-   fprintf(out,"time");
+   /* Describe the columns and start writing the output */
+   writer_column("s",SCALE_MICRO,"time");
    for(i=0; i<core_count; i++)
       for(j=0;j<NUM_RAPL_DOMAINS;j++) {
          if (fd[i][j]!=-1) {
-            fprintf(out," core_%d_%s",query_cores[i],rapl_domain_names[j]);
+            writer_column("W",SCALE_MILLI,"core_%d_%s",query_cores[i],rapl_domain_names[j]);
          }
       }
 #if NVIDIA
    for(i=0; i<device_count; i++)
-     fprintf(out," nvd_%d",i);
+     writer_column("W",SCALE_MILLI,"nvd_%d",i);
 #endif
 #if XEONPHI
-   fprintf(out," mic");
+   writer_column("W",SCALE_MILLI,"mic");
 #endif
-   fprintf(out,"\n");
+   if(cgroup_stat_fd != -1)
+      writer_column("W",SCALE_MILLI,"cgroup_pkg");
+   if(count_work) {
+      writer_column("units/s",SCALE_MILLI,"work_rate");
+      /* Units can take as little as a few millijoules */
+      writer_column("J/unit",SCALE_MICRO,"joules_per_unit");
+   }
+   if(writer_start(out, format) < 0)
+      close_and_exit(0);
 
-   /* If the ROI analysis flag is not set, start measurements immediately */
-   if(! flag_roi) {
-      reset_rapl_perf();
-#if NVIDIA
-      reset_nvml();
-#endif
-      ualarm(interval, interval);
-      gettimeofday(&last_time,NULL);
+   /* When attached to a process or cgroup, measure until it goes away or
+    * sauna is told to stop. SIGINT and SIGTERM are only let through while
+    * waiting, so that they can not arrive between checking the flag and
+    * going to sleep. */
+   if(attach_pid || cgroup_path) {
+      sigemptyset(&stop_signals);
+      sigaddset(&stop_signals, SIGINT);
+      sigaddset(&stop_signals, SIGTERM);
+      sigprocmask(SIG_BLOCK, &stop_signals, &wait_mask);
+      signal (SIGINT, interrupt_handler);
+      signal (SIGTERM, interrupt_handler);
+      start_measurements();
+      if(attach_pid)
+         wait_pid_exit();
+      else
+         wait_cgroup_empty();
+      stop_measurements(interrupted ? TRIGGER_SIGNAL : TRIGGER_EXIT);
+      if(flag_total != 0) print_total_energy();
+      close_and_exit(1);
    }
+
+   /* If the ROI analysis flag is not set, start measurements immediately */
+   if(! flag_roi)
+      start_measurements();
    /* The master process reads stdin of the child process */
    while ((read = getline(&line, &len, child_stdout)) != -1) {
       /* If ROI analysis is set, and begining of ROI is detected start measurements */
       if(flag_roi && strstr(line, "++ROI")) {
-         reset_rapl_perf();
-#if NVIDIA
-         reset_nvml();
-#endif
-         ualarm(interval, interval);
-         gettimeofday(&last_time,NULL);
+         if(flight)
+            atomic_store(&pending_trigger, TRIGGER_ROI);
+         start_measurements();
       }
       /* Stop measurements at the end of the ROI */
       else if(flag_roi && strstr(line, "--ROI")) {
          flag_roi = 1;
-         ualarm(0, interval);
+         stop_measurements(TRIGGER_ROI);
          if(flag_total != 0) print_total_energy();
       }
+      /* Count the work units completed by the command */
+      if(count_work && (marker = strstr(line, "++WORK")) && (l = parse_work(marker+strlen("++WORK"))) > 0)
+         atomic_fetch_add(&work_units, l);
       fputs(line, stdout);
    }
    /* Stop measurements when the child dies */
    if(flag_roi < 1) {
-      ualarm(0, interval);
+      stop_measurements(TRIGGER_EXIT);
       if(flag_total != 0) print_total_energy();
    }
 
@@ -338,7 +558,9 @@ int main(int argc, char **argv)
 }
 
 void usage(int argc, char **argv) {
-      printf ("Usage: %s [-rtvh] [-o<file>] [-i<ms>] <command> [<arguments>]\n", argv[0]);
+      printf ("Usage: %s [-rtwzjvh] [-o<file>] [-i<ms>] [-f<s> [-P<W>]] <command> [<arguments>]\n", argv[0]);
+      printf ("       %s [-tzjvh] [-o<file>] [-i<ms>] [-f<s> [-P<W>]] -p <pid> | --cgroup <path>\n", argv[0]);
+      printf ("       %s -d<file>\n", argv[0]);
 }
 
 void help(int argc, char **argv) {
@@ -354,10 +576,42 @@ void help(int argc, char **argv) {
             "\n"
             "   -t Causes the total time and energy to be written to the output file.\n"
             "\n"
+            "   -w Counts the work units completed by <command>, which writes \"++WORK <n>\" to\n"
+            "      stdout after completing n units (1 if n is omitted). Adds columns with the\n"
+            "      units per second and joules per unit, counting package, memory and device\n"
+            "      energy, for each interval and, with -t, for the whole measurement.\n"
+            "\n"
             "   -o Sets the output file. By default it sends data to stdout. \n"
             "\n"
+            "   -f Turns on the flight recorder, that keeps the samples of the last <s> seconds in\n"
+            "      memory and writes only a summary with their mean every second. When triggered,\n"
+            "      it writes the samples kept and those of the following <s> seconds. It is\n"
+            "      triggered at the start and end of the ROI, when sauna receives SIGUSR1, when\n"
+            "      the measurements end and, with -P, when power exceeds <W> watts, counting\n"
+            "      package, memory and device power.\n"
+            "\n"
+            "   -z Writes the output file in a compact binary format, meant for long monitoring\n"
+            "      sessions. Requires -o. The file can be read up to its last complete block\n"
+            "      even if it was truncated.\n"
+            "\n"
+            "   -j Writes the output file in Chrome Trace Event JSON, that can be loaded in\n"
+            "      Perfetto or chrome://tracing along with traces of <command>. Timestamps are\n"
+            "      CLOCK_MONOTONIC, each column is a counter track, with another with the energy\n"
+            "      of those in watts, and the ROI is a slice. Requires -o.\n"
+            "\n"
+            "   -d Converts <file>, written with -z, back to text on stdout.\n"
+            "\n"
             "   -i Sets the sampling interval in ms. Default 500ms. Interval can not exceed 999ms. \n"
             "\n"
+            "   -p Attaches to the already running process <pid> instead of launching <command>.\n"
+            "      Measurements start immediately and stop when the process exits, or when\n"
+            "      sauna receives SIGINT or SIGTERM.\n"
+            "\n"
+            "   --cgroup Attaches to the cgroup (v2) at <path>. Measurements start immediately and\n"
+            "      stop when the cgroup becomes empty, or on SIGINT or SIGTERM. If the cgroup\n"
+            "      CPU time is available, the package power is apportioned to it in an extra\n"
+            "      cgroup_pkg column.\n"
+            "\n"
             "   -v Show version number.\n"
             "\n"
             "   -h Displays this message.\n"
@@ -407,7 +661,7 @@ void reset_nvml() {
       nvml_energy[i] = 0;
 }
  
-void query_nvml_device_power(int device, long long delta) {
+double query_nvml_device_power(int device, long long delta) {
    nvmlReturn_t result;
    unsigned int power_usage;
    
@@ -420,11 +674,12 @@ void query_nvml_device_power(int device, long long delta) {
       }
    }
    nvml_energy[device] += (double)power_usage/1000*delta*1e-6;
-   fprintf(out,"%f ",(double)power_usage/1000);
+   writer_value((double)power_usage/1000);
+   return (double)power_usage/1000;
 }
 
 void query_nvml_device_energy(int device) {
-   fprintf(out,"%f ",nvml_energy[device]);
+   writer_value(nvml_energy[device]);
 }
 
 #endif
@@ -433,7 +688,7 @@ void query_nvml_device_energy(int device) {
 void reset_mic() {
    mic_energy = 0;
 }
-void query_mic_device_power(long long delta) {
+double query_mic_device_power(long long delta) {
    struct mic_power_util_info *pinfo;
    uint32_t power_usage;
 
@@ -451,13 +706,14 @@ void query_mic_device_power(long long delta) {
       close_and_exit(0);
    }
    mic_energy += (double)power_usage/1000000*delta*1e-6;
-   fprintf(out,"%f ",(double)power_usage/1000000);
+   writer_value((double)power_usage/1000000);
 
    (void)mic_free_power_utilization_info(pinfo);
+   return (double)power_usage/1000000;
 }
 
 void query_mic_device_energy() {
-   fprintf(out,"%f ",mic_energy);
+   writer_value(mic_energy);
 }
 
 int init_mic()
@@ -552,7 +808,191 @@ void print_mic_error(const char *msg, const char *device_name)
 }
 #endif
 
+int init_cgroup(const char *path) {
+   char filename[BUFSIZ];
+
+   snprintf(filename,sizeof(filename),"%s/cgroup.events",path);
+   if((cgroup_events_fd = open(filename,O_RDONLY|O_CLOEXEC)) < 0) {
+      fprintf(stderr,"Could not open %s: %s\n",filename,strerror(errno));
+      return -1;
+   }
+   if(cgroup_populated() <= 0) {
+      fprintf(stderr,"Cgroup %s has no processes\n",path);
+      return -1;
+   }
+
+   /* CPU time accounting is optional; without it no energy is apportioned */
+   snprintf(filename,sizeof(filename),"%s/cpu.stat",path);
+   cgroup_stat_fd = open(filename,O_RDONLY|O_CLOEXEC);
+   root_stat_fd = open(CGROUP_ROOT "/cpu.stat",O_RDONLY|O_CLOEXEC);
+   if(cgroup_stat_fd != -1 && read_cpu_usage(cgroup_stat_fd) < 0) {
+      close(cgroup_stat_fd);
+      cgroup_stat_fd = -1;
+   }
+   if(root_stat_fd != -1 && read_cpu_usage(root_stat_fd) < 0) {
+      close(root_stat_fd);
+      root_stat_fd = -1;
+   }
+#ifdef VERBOSE
+   fprintf(stderr,"Cgroup %s: cpu.stat %s, root cpu.stat %s\n",path,
+         cgroup_stat_fd != -1 ? "found" : "not found", root_stat_fd != -1 ? "found" : "not found");
+#endif
+   return 0;
+}
+
+void reset_cgroup() {
+   cgroup_energy = 0;
+   if(cgroup_stat_fd != -1)
+      last_cgroup_usage = read_cpu_usage(cgroup_stat_fd);
+   if(root_stat_fd != -1)
+      last_root_usage = read_cpu_usage(root_stat_fd);
+}
+
+/* Returns the usage_usec field of a cpu.stat file, or -1 on failure */
+long long read_cpu_usage(int stat_fd) {
+   char buf[256];
+   ssize_t n;
+   char *p;
+
+   if((n = pread(stat_fd,buf,sizeof(buf)-1,0)) <= 0)
+      return -1;
+   buf[n] = '\0';
+   if((p = strstr(buf,"usage_usec ")) == NULL)
+      return -1;
+   return strtoll(p+strlen("usage_usec "),NULL,10);
+}
+
+/* Returns 1 if the cgroup has live processes, 0 if it is empty, -1 on failure */
+int cgroup_populated() {
+   char buf[256];
+   ssize_t n;
+   char *p;
+
+   if((n = pread(cgroup_events_fd,buf,sizeof(buf)-1,0)) <= 0)
+      return -1;
+   buf[n] = '\0';
+   if((p = strstr(buf,"populated ")) == NULL)
+      return -1;
+   return p[strlen("populated ")] == '1';
+}
+
+/* Prints the share of the package power that corresponds to the CPU time
+ * consumed by the cgroup in the last interval. The share is relative to the
+ * CPU time of the whole machine if available, or to its capacity otherwise. */
+void query_cgroup_power(double pkg_power, long long delta) {
+   long long usage, root_usage;
+   double share = 0;
+
+   if(cgroup_stat_fd == -1)
+      return;
+   usage = read_cpu_usage(cgroup_stat_fd);
+   root_usage = root_stat_fd != -1 ? read_cpu_usage(root_stat_fd) : 0;
+   /* Once the cgroup is removed its usage can not be read. Keep the column,
+    * but leave the energy and the previous usage as they are */
+   if(usage < 0 || root_usage < 0) {
+      writer_value(0);
+      return;
+   }
+   if(root_stat_fd != -1) {
+      if(root_usage > last_root_usage)
+         share = (double)(usage-last_cgroup_usage)/(root_usage-last_root_usage);
+      last_root_usage = root_usage;
+   }
+   else if(delta > 0) {
+      share = (double)(usage-last_cgroup_usage)/(delta*sysconf(_SC_NPROCESSORS_ONLN));
+   }
+   if(share < 0) share = 0;
+   if(share > 1) share = 1;
+   last_cgroup_usage = usage;
+   cgroup_energy += pkg_power*share*delta*1e-6;
+   writer_value(pkg_power*share);
+}
+
+void query_cgroup_energy() {
+   if(cgroup_stat_fd != -1)
+      writer_value(cgroup_energy);
+}
+
+void close_cgroup() {
+   if(cgroup_events_fd != -1)
+      close(cgroup_events_fd);
+   if(cgroup_stat_fd != -1)
+      close(cgroup_stat_fd);
+   if(root_stat_fd != -1)
+      close(root_stat_fd);
+   cgroup_events_fd = cgroup_stat_fd = root_stat_fd = -1;
+}
+
+/* Sleeps until the attached process exits. The pidfd becomes readable then,
+ * so poll only returns early when interrupted by the sampling alarm or a
+ * request to stop. */
+int wait_pid_exit() {
+   struct pollfd pfd = { .fd = attach_pidfd, .events = POLLIN };
+
+   while(! interrupted && ppoll(&pfd,1,NULL,&wait_mask) < 0) {
+      if(errno != EINTR) {
+         fprintf(stderr,"Error waiting for process %d: %s\n",attach_pid,strerror(errno));
+         return -1;
+      }
+   }
+   return 0;
+}
+
+/* Sleeps until the monitored cgroup has no processes left. The kernel
+ * signals every change of cgroup.events with POLLPRI. */
+int wait_cgroup_empty() {
+   struct pollfd pfd = { .fd = cgroup_events_fd, .events = POLLPRI };
+
+   while(! interrupted && cgroup_populated() > 0) {
+      if(ppoll(&pfd,1,NULL,&wait_mask) < 0 && errno != EINTR) {
+         fprintf(stderr,"Error waiting for cgroup %s: %s\n",cgroup_path,strerror(errno));
+         return -1;
+      }
+   }
+   return 0;
+}
+
+/* Returns the units given after a "++WORK" marker, 1 if none is given, or 0
+ * if the marker is not followed by blanks or a positive number */
+long parse_work(const char *p) {
+   char *endp;
+   long units;
+
+   if(*p != '\0' && !isspace(*p))
+      return 0;
+   while(isspace(*p))
+      p++;
+   if(*p == '\0')
+      return 1;
+   units = strtol(p, &endp, 10);
+   if(endp == p || (*endp != '\0' && !isspace(*endp)) || units <= 0)
+      return 0;
+   return units;
+}
+
+void reset_work() {
+   first_work = last_work = atomic_load(&work_units);
+}
+
+/* Prints the work units completed per second in the last interval, and the
+ * energy spent on each of them. Both are 0 if no work was completed. */
+void query_work_rate(double power, double delta) {
+   long long units = atomic_load(&work_units);
+
+   writer_value(delta > 0 ? (units-last_work)/delta : 0);
+   writer_value(units > last_work ? power*delta/(units-last_work) : 0);
+   last_work = units;
+}
+
+void query_work_total(double energy, double elapsed) {
+   long long units = atomic_load(&work_units);
+
+   writer_value(elapsed > 0 ? (units-first_work)/elapsed : 0);
+   writer_value(units > first_work ? energy/(units-first_work) : 0);
+}
+
 void close_and_exit(int code) {
+   writer_stop();
 #if NVIDIA
    nvmlReturn_t result;
    if(nvml_up) {
@@ -567,52 +1007,145 @@ void close_and_exit(int code) {
    if(mic_up)
       close_mic();
 #endif
+   close_cgroup();
+   if(attach_pidfd != -1)
+      close(attach_pidfd);
    exit(code);
 }
 
 void alarm_handler (int signo)
 {
    int i;
+   int reason;
    struct timeval time;
    double now;
-   static double before = 0;
+   double pkg_power = 0;
+   double node_power = 0;
 
    gettimeofday(&time,NULL);
 
    now = (time.tv_sec-last_time.tv_sec)+(time.tv_usec-last_time.tv_usec)*1e-6;
-   if(before == 0) before = now-interval;
-   fprintf(out,"%f ",(double) now);
+   writer_begin(RECORD_SAMPLE);
+   writer_value(now);
    for(i=0; i<core_count; i++)
-      query_rapl_device_power(i,(now-before)*1e6);
+      pkg_power += query_rapl_device_power(i,(now-last_sample)*1e6,&node_power);
 #if NVIDIA
    for(i=0; i<device_count; i++)
-      query_nvml_device_power(i,interval);
+      node_power += query_nvml_device_power(i,interval);
 #endif
 #if XEONPHI
-   query_mic_device_power(interval);
+   node_power += query_mic_device_power(interval);
+#endif
+   query_cgroup_power(pkg_power,(now-last_sample)*1e6);
+   if(count_work)
+      query_work_rate(node_power,now-last_sample);
+   writer_commit();
+   /* Triggers go after the sample, so that it is part of the window written */
+   if(flight) {
+      if((reason = atomic_exchange(&pending_trigger, 0)) != 0)
+         record_trigger(reason, now);
+      else if(trigger_power && node_power > trigger_power)
+         record_trigger(TRIGGER_POWER, now);
+   }
+   last_sample = now;
+}
+
+void interrupt_handler (int signo)
+{
+   interrupted = 1;
+}
+
+void usr1_handler (int signo)
+{
+   atomic_store(&pending_trigger, TRIGGER_SIGNAL);
+}
+
+void record_trigger(int reason, double now) {
+   writer_begin(RECORD_TRIGGER);
+   writer_value(now);
+   writer_value(reason);
+   writer_commit();
+}
+
+/* Marks the start and end of the measurements. Must be called with the
+ * alarm off, so that the sampler does not fill a record at the same time */
+void record_roi(int kind, double now) {
+   /* Only the ROI set with -r is marked, and an end only closes an open one */
+   if(! mark_roi || roi_open == (kind == RECORD_ROI_BEGIN))
+      return;
+   roi_open = kind == RECORD_ROI_BEGIN;
+   writer_begin(kind);
+   writer_value(now);
+   writer_commit();
+}
+
+/* Starts the sampling alarm. It may already be running if the ROI starts
+ * again without ending, so stop it first: the counters are reset and the
+ * ROI record queued without the sampler interrupting. */
+void start_measurements() {
+   struct timeval time;
+
+   ualarm(0, interval);
+   /* A ++ROI without a --ROI before it ends the ROI that was open */
+   if(roi_open) {
+      gettimeofday(&time,NULL);
+      record_roi(RECORD_ROI_END, (time.tv_sec-last_time.tv_sec)+(time.tv_usec-last_time.tv_usec)*1e-6);
+   }
+   reset_rapl_perf();
+#if NVIDIA
+   reset_nvml();
 #endif
-   fprintf(out,"\n");
-   before = now;
+   if(cgroup_path)
+      reset_cgroup();
+   if(count_work)
+      reset_work();
+   record_roi(RECORD_ROI_BEGIN, 0);
+   last_sample = 0;
+   ualarm(interval, interval);
+   gettimeofday(&last_time,NULL);
+}
+
+/* Stops the sampling alarm. With the flight recorder, the end of the
+ * measurements triggers it, as there is no next sample to record it with. */
+void stop_measurements(int reason) {
+   struct timeval time;
+   double now;
+
+   ualarm(0, interval);
+   gettimeofday(&time,NULL);
+   now = (time.tv_sec-last_time.tv_sec)+(time.tv_usec-last_time.tv_usec)*1e-6;
+   if(flight)
+      record_trigger(reason, now);
+   record_roi(RECORD_ROI_END, now);
 }
 
 void print_total_energy() {
    int i;
    struct timeval time;
+   double elapsed;
+   double node_energy = 0;
 
-   fprintf(out,"Totals: ");
    gettimeofday(&time,NULL);
+   writer_begin(RECORD_TOTALS);
 
-   fprintf(out,"%f ",(double) (time.tv_sec-last_time.tv_sec)+(time.tv_usec-last_time.tv_usec)*1e-6);
+   elapsed = (double) (time.tv_sec-last_time.tv_sec)+(time.tv_usec-last_time.tv_usec)*1e-6;
+   writer_value(elapsed);
    for(i=0; i<core_count; i++)
-      query_rapl_device_energy(i);
+      node_energy += query_rapl_device_energy(i);
 #if NVIDIA
-   for(i=0; i<device_count; i++)
+   for(i=0; i<device_count; i++) {
       query_nvml_device_energy(i);
+      node_energy += nvml_energy[i];
+   }
 #endif
 #if XEONPHI
    query_mic_device_energy();
+   node_energy += mic_energy;
 #endif
-   fprintf(out,"\n");
+   query_cgroup_energy();
+   if(count_work)
+      query_work_total(node_energy,elapsed);
+   writer_commit();
 }
 
 int perf_event_open(struct perf_event_attr *hw_event_uptr,
@@ -728,27 +1261,40 @@ void reset_rapl_perf() {
    }
 }
 
-void query_rapl_device_power(int core,long long delta) {
+/* Prints the power of every RAPL domain of a core and returns that of the
+ * package. The power of the package and memory is added to node_power. */
+double query_rapl_device_power(int core,long long delta,double *node_power) {
    int i;
    long long value;
+   double power, pkg_power = 0;
    for(i=0;i<NUM_RAPL_DOMAINS;i++) {
       if (fd[core][i]!=-1) {
          read(fd[core][i],&value,8);
-         fprintf(out,"%lf ",(double)(value-last_value[core][i])*scale[i]/delta/1e-6);
+         power = (double)(value-last_value[core][i])*scale[i]/delta/1e-6;
+         writer_value(power);
          last_value[core][i] = value;
+         if (i == RAPL_PKG) pkg_power = power;
+         if (i == RAPL_PKG || i == RAPL_RAM) *node_power += power;
       }
    }
+   return pkg_power;
 }
 
-void query_rapl_device_energy(int core) {
+/* Prints the energy of every RAPL domain of a core and returns that of the
+ * package and memory */
+double query_rapl_device_energy(int core) {
    int i;
    long long value;
+   double energy, node_energy = 0;
    for(i=0;i<NUM_RAPL_DOMAINS;i++) {
       if (fd[core][i]!=-1) {
          read(fd[core][i],&value,8);
-         fprintf(out,"%lf ",(double)(value-first_value[core][i])*scale[i]);
+         energy = (double)(value-first_value[core][i])*scale[i];
+         writer_value(energy);
+         if (i == RAPL_PKG || i == RAPL_RAM) node_energy += energy;
       }
    }
+   return node_energy;
 }
 
 void close_rapl_perf() {
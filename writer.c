@@ -0,0 +1,835 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#if ZSTD
+#include <zstd.h>
+#endif
+
+#include "writer.h"
+
+/* BEGIN CONFGURATION */
+/* Number of records that can wait in the queue to be written */
+#define QUEUE_SLOTS	1024
+/* Size of the output buffer for the trace format */
+#define TRACE_BUFFER	(1 << 20)
+/* Size of uncompressed blocks in the compressed format */
+#define BLOCK_SIZE	65536
+/* Seconds after which a partial block is written anyway, bounding what is
+ * lost if sauna is killed */
+#define BLOCK_FLUSH_INTERVAL	10
+/* END CONFGURATION */
+
+/* Magic strings of the compressed format */
+#define FILE_MAGIC	"SAUNAZ2\n"
+#define BLOCK_MAGIC	"SZB1"
+#define INDEX_MAGIC	"SZIX"
+
+/* Block codecs */
+#define CODEC_RAW	0
+#define CODEC_LZ	1
+#define CODEC_ZSTD	2
+
+/* Size of the block header: magic, codec, raw size, compressed size and checksum */
+#define BLOCK_HEADER	17
+/* Number of record kinds, and bits to encode them */
+#define RECORD_KINDS	8
+#define KIND_BITS	3
+/* Largest encoding of a record: kind and count plus one varint per column */
+#define MAX_RECORD_SIZE	(10*(MAX_COLUMNS+1))
+
+/* Parameters of the built-in LZ codec */
+#define LZ_MIN_MATCH	4
+#define LZ_HASH_BITS	12
+#define LZ_MAX_OFFSET	65535
+
+struct record {
+   int kind;
+   int count;
+   /* CLOCK_MONOTONIC time in ns, to align with other traces */
+   int64_t timestamp;
+   double value[MAX_COLUMNS];
+   /* Energy of the columns in watts since the start of the measurements, for traces */
+   double energy[MAX_COLUMNS];
+};
+
+/* Header of the output */
+static char column_names[MAX_COLUMNS][32];
+static char column_units[MAX_COLUMNS][16];
+static int column_scales[MAX_COLUMNS];
+static int column_count = 0;
+
+/* Queue of records between the sampler and the writer thread. Only the
+ * sampler advances the head and only the writer advances the tail. */
+static struct record queue[QUEUE_SLOTS];
+static atomic_uint queue_head;
+static atomic_uint queue_tail;
+/* Record being filled by the sampler, and a spare one to fill when the queue is full */
+static struct record *current;
+static struct record spare;
+/* Number of records dropped because the queue was full */
+static unsigned long dropped = 0;
+/* The writer thread sleeps on this semaphore, posted for each record */
+static sem_t queue_sem;
+static atomic_int stopping;
+static pthread_t writer_thread;
+static int writer_up = 0;
+
+/* Destination and format of the output */
+static FILE *writer_out;
+static int writer_format;
+
+/* Textual description of the kinds of records and of trigger reasons */
+static const char *record_prefix[RECORD_KINDS] = { "", "Totals: ", "Summary: ", "Trigger: " };
+static const char *trigger_names[] = { "unknown", "power", "roi", "signal", "exit" };
+
+/* Ring of samples kept by the flight recorder, its size, the position of
+ * the oldest sample and the number of samples in it */
+static struct record *ring = NULL;
+static int ring_slots = 0;
+static int ring_first = 0;
+static int ring_count = 0;
+/* Samples still to be written as they come after the last trigger */
+static int live_left = 0;
+/* Sums of the samples since the last summary, and how many per summary */
+static struct record summary;
+static int summary_count = 0;
+static int summary_slots = 0;
+
+/* Trace format: pid of the process the tracks belong to, timestamp of the
+ * last sample and energy integrated from each power column up to it */
+static pid_t trace_pid;
+static char trace_buffer[TRACE_BUFFER];
+static int64_t trace_last = 0;
+static double trace_energy[MAX_COLUMNS];
+
+/* Block being built in compressed format, with the previous fixed point
+ * values of each kind of record, against which deltas are computed */
+static uint8_t block[BLOCK_SIZE];
+static size_t block_len = 0;
+/* Time by which the current block must be written, even if not full */
+static struct timespec block_deadline;
+static int64_t previous[RECORD_KINDS][MAX_COLUMNS];
+/* Bytes written so far and offsets of the blocks for the index */
+static uint64_t written = 0;
+static uint64_t *block_offsets = NULL;
+static size_t block_count = 0;
+static size_t block_alloc = 0;
+
+static void *writer_main(void *arg);
+static void process_record(struct record *r);
+static void write_record(struct record *r);
+static void print_record(FILE *out, struct record *r);
+static void trace_record(struct record *r);
+static void integrate_energy(struct record *r);
+static void encode_record(struct record *r);
+static void flush_block();
+static void write_index();
+
+void writer_column(const char *unit, int scale, const char *fmt, ...) {
+   va_list ap;
+
+   if(column_count == MAX_COLUMNS) {
+      fprintf(stderr,"Too many columns. Increase MAX_COLUMNS and recompile.\n");
+      return;
+   }
+   snprintf(column_units[column_count], sizeof(column_units[0]), "%s", unit);
+   column_scales[column_count] = scale;
+   va_start(ap, fmt);
+   vsnprintf(column_names[column_count++], sizeof(column_names[0]), fmt, ap);
+   va_end(ap);
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+   p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+   return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+   put_u32(p, v);
+   put_u32(p+4, v >> 32);
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+   return get_u32(p) | (uint64_t)get_u32(p+4) << 32;
+}
+
+/* Writes all of buf to the output, keeping count of the bytes written */
+static void write_out(const void *buf, size_t len) {
+   if(fwrite(buf, 1, len, writer_out) != len)
+      fprintf(stderr,"Error writing output: %s\n", strerror(errno));
+   written += len;
+}
+
+int writer_flight(int window, int summary) {
+   if(window < 1 || summary < 1)
+      return -1;
+   if((ring = calloc(window, sizeof(*ring))) == NULL) {
+      fprintf(stderr,"Could not allocate %d samples for the flight recorder.\n", window);
+      return -1;
+   }
+   ring_slots = window;
+   summary_slots = summary;
+   return 0;
+}
+
+int writer_start(FILE *out, int format) {
+   int i;
+   uint8_t buf[8];
+   sigset_t all, old;
+
+   writer_out = out;
+   writer_format = format;
+
+   if(format == FORMAT_COMPRESSED) {
+      write_out(FILE_MAGIC, 8);
+      put_u32(buf, column_count);
+      write_out(buf, 4);
+      for(i=0; i<column_count; i++) {
+         write_out(column_names[i], strlen(column_names[i])+1);
+         put_u32(buf, column_scales[i]);
+         write_out(buf, 4);
+      }
+   }
+   else if(format == FORMAT_TRACE) {
+      /* Events are many and small, so write them in large chunks */
+      setvbuf(out, trace_buffer, _IOFBF, TRACE_BUFFER);
+      trace_pid = getpid();
+      fprintf(out,"{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+      fprintf(out,"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"sauna\"}}", trace_pid);
+   }
+   else {
+      for(i=0; i<column_count; i++)
+         fprintf(out,"%s%s", i ? " " : "", column_names[i]);
+      fprintf(out,"\n");
+   }
+   fflush(out);
+
+   atomic_init(&queue_head, 0);
+   atomic_init(&queue_tail, 0);
+   atomic_init(&stopping, 0);
+   current = &spare;
+   if(sem_init(&queue_sem, 0, 0) < 0) {
+      fprintf(stderr,"Error creating writer semaphore: %s\n", strerror(errno));
+      return -1;
+   }
+
+   /* The writer thread must not receive the sampling alarm or other signals */
+   sigfillset(&all);
+   pthread_sigmask(SIG_BLOCK, &all, &old);
+   i = pthread_create(&writer_thread, NULL, writer_main, NULL);
+   pthread_sigmask(SIG_SETMASK, &old, NULL);
+   if(i != 0) {
+      fprintf(stderr,"Error creating writer thread: %s\n", strerror(i));
+      return -1;
+   }
+   writer_up = 1;
+   return 0;
+}
+
+void writer_begin(int kind) {
+   unsigned head = atomic_load_explicit(&queue_head, memory_order_relaxed);
+   unsigned tail = atomic_load_explicit(&queue_tail, memory_order_acquire);
+   struct timespec now;
+
+   current = head - tail < QUEUE_SLOTS ? &queue[head % QUEUE_SLOTS] : &spare;
+   current->kind = kind;
+   current->count = 0;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   current->timestamp = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void writer_value(double value) {
+   if(current->count < MAX_COLUMNS)
+      current->value[current->count++] = value;
+}
+
+void writer_commit() {
+   unsigned head;
+
+   if(current == &spare || ! writer_up) {
+      dropped++;
+      return;
+   }
+   head = atomic_load_explicit(&queue_head, memory_order_relaxed);
+   atomic_store_explicit(&queue_head, head+1, memory_order_release);
+   sem_post(&queue_sem);
+}
+
+void writer_stop() {
+   if(! writer_up)
+      return;
+   writer_up = 0;
+   atomic_store(&stopping, 1);
+   sem_post(&queue_sem);
+   pthread_join(writer_thread, NULL);
+   sem_destroy(&queue_sem);
+   if(dropped)
+      fprintf(stderr,"Warning: %lu samples dropped because output could not keep up.\n", dropped);
+}
+
+static void *writer_main(void *arg) {
+   unsigned head, tail;
+   struct timespec now;
+
+   for(;;) {
+      /* With a block pending, wake up to write it in time even if no samples come */
+      if(writer_format == FORMAT_COMPRESSED && block_len > 0)
+         while(sem_timedwait(&queue_sem, &block_deadline) < 0 && errno == EINTR);
+      else
+         while(sem_wait(&queue_sem) < 0 && errno == EINTR);
+      head = atomic_load_explicit(&queue_head, memory_order_acquire);
+      tail = atomic_load_explicit(&queue_tail, memory_order_relaxed);
+      while(tail != head) {
+         process_record(&queue[tail % QUEUE_SLOTS]);
+         atomic_store_explicit(&queue_tail, ++tail, memory_order_release);
+      }
+      if(atomic_load(&stopping))
+         break;
+      /* Text is for humans watching, so show it as soon as the sampler is idle */
+      if(writer_format == FORMAT_TEXT)
+         fflush(writer_out);
+      if(writer_format == FORMAT_COMPRESSED && block_len > 0) {
+         clock_gettime(CLOCK_REALTIME, &now);
+         if(now.tv_sec > block_deadline.tv_sec ||
+               (now.tv_sec == block_deadline.tv_sec && now.tv_nsec >= block_deadline.tv_nsec))
+            flush_block();
+      }
+   }
+   if(writer_format == FORMAT_COMPRESSED) {
+      flush_block();
+      write_index();
+   }
+   else if(writer_format == FORMAT_TRACE)
+      fprintf(writer_out,"\n]}\n");
+   fflush(writer_out);
+   free(ring);
+   ring = NULL;
+   return NULL;
+}
+
+/* Without the flight recorder every record is written. With it, samples go
+ * to the ring and the summary unless a trigger was recent. */
+static void process_record(struct record *r) {
+   int i;
+
+   /* Energy is integrated as samples arrive, in time order, before the flight
+    * recorder may delay them */
+   if(writer_format == FORMAT_TRACE)
+      integrate_energy(r);
+
+   if(ring == NULL || (r->kind != RECORD_SAMPLE && r->kind != RECORD_TRIGGER)) {
+      write_record(r);
+      return;
+   }
+   if(r->kind == RECORD_TRIGGER) {
+      /* A trigger while samples are being written just extends the window */
+      if(live_left == 0) {
+         write_record(r);
+         for(; ring_count; ring_count--, ring_first = (ring_first+1) % ring_slots)
+            write_record(&ring[ring_first]);
+      }
+      live_left = ring_slots;
+      return;
+   }
+
+   if(live_left > 0) {
+      write_record(r);
+      live_left--;
+   }
+   else {
+      ring[(ring_first + ring_count) % ring_slots] = *r;
+      if(ring_count < ring_slots)
+         ring_count++;
+      else
+         ring_first = (ring_first+1) % ring_slots;
+   }
+
+   /* Summaries hold the mean of each column, and the time of the last sample */
+   if(summary.count == 0) {
+      summary.kind = RECORD_SUMMARY;
+      summary.count = r->count;
+      memset(summary.value, 0, sizeof(summary.value));
+   }
+   for(i=0; i<r->count && i<summary.count; i++)
+      summary.value[i] += r->value[i];
+   summary.value[0] = r->value[0];
+   if(++summary_count == summary_slots) {
+      summary.timestamp = r->timestamp;
+      memcpy(summary.energy, r->energy, sizeof(summary.energy));
+      for(i=1; i<summary.count; i++)
+         summary.value[i] /= summary_slots;
+      write_record(&summary);
+      summary.count = 0;
+      summary_count = 0;
+   }
+}
+
+static void write_record(struct record *r) {
+   if(writer_format == FORMAT_COMPRESSED) {
+      if(block_len + MAX_RECORD_SIZE > BLOCK_SIZE)
+         flush_block();
+      encode_record(r);
+      return;
+   }
+   if(writer_format == FORMAT_TRACE) {
+      trace_record(r);
+      return;
+   }
+   print_record(writer_out, r);
+}
+
+static void print_record(FILE *out, struct record *r) {
+   int i;
+
+   /* The ROI is only shown in traces */
+   if(r->kind == RECORD_ROI_BEGIN || r->kind == RECORD_ROI_END)
+      return;
+   fprintf(out,"%s",record_prefix[r->kind]);
+   if(r->kind == RECORD_TRIGGER && r->count == 2) {
+      i = r->value[1];
+      fprintf(out,"%f %s\n",r->value[0],trigger_names[i > 0 && i <= TRIGGER_EXIT ? i : 0]);
+      return;
+   }
+   for(i=0; i<r->count; i++)
+      fprintf(out,"%f ",r->value[i]);
+   fprintf(out,"\n");
+}
+
+/* Adds the energy of the power columns in the interval since the last sample,
+ * and keeps the total so far in the record */
+static void integrate_energy(struct record *r) {
+   double dt;
+   int i;
+
+   if(r->kind == RECORD_ROI_BEGIN) {
+      trace_last = r->timestamp;
+      memset(trace_energy, 0, sizeof(trace_energy));
+      return;
+   }
+   if(r->kind != RECORD_SAMPLE)
+      return;
+   dt = trace_last ? (r->timestamp - trace_last) * 1e-9 : 0;
+   trace_last = r->timestamp;
+   for(i=1; i<r->count && i<column_count; i++)
+      if(strcmp(column_units[i], "W") == 0)
+         trace_energy[i] += r->value[i] * dt;
+   memcpy(r->energy, trace_energy, sizeof(trace_energy));
+}
+
+/* Writes a record as Chrome Trace Event JSON, readable by Perfetto too.
+ * Samples and summaries become a counter track per column, with another
+ * with the energy of those measured in watts. The ROI becomes a slice,
+ * and triggers and totals instant events. */
+static void trace_record(struct record *r) {
+   FILE *out = writer_out;
+   double ts = r->timestamp / 1000.0;
+   int i;
+
+   switch(r->kind) {
+      case RECORD_SAMPLE:
+      case RECORD_SUMMARY:
+         for(i=1; i<r->count && i<column_count; i++) {
+            fprintf(out,",\n{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%d,\"args\":{\"%s\":%f}}",
+                  column_names[i], ts, trace_pid, column_units[i], r->value[i]);
+            if(strcmp(column_units[i], "W") == 0)
+               fprintf(out,",\n{\"name\":\"%s energy\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%d,\"args\":{\"J\":%f}}",
+                     column_names[i], ts, trace_pid, r->energy[i]);
+         }
+         break;
+      case RECORD_ROI_BEGIN:
+      case RECORD_ROI_END:
+         fprintf(out,",\n{\"name\":\"ROI\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+               r->kind == RECORD_ROI_BEGIN ? "B" : "E", ts, trace_pid, trace_pid);
+         break;
+      case RECORD_TRIGGER:
+         i = r->count == 2 ? r->value[1] : 0;
+         fprintf(out,",\n{\"name\":\"trigger: %s\",\"ph\":\"i\",\"s\":\"p\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+               trigger_names[i > 0 && i <= TRIGGER_EXIT ? i : 0], ts, trace_pid, trace_pid);
+         break;
+      case RECORD_TOTALS:
+         fprintf(out,",\n{\"name\":\"totals\",\"ph\":\"i\",\"s\":\"p\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{",
+               ts, trace_pid, trace_pid);
+         for(i=0; i<r->count && i<column_count; i++)
+            fprintf(out,"%s\"%s\":%f", i ? "," : "", column_names[i], r->value[i]);
+         fprintf(out,"}}");
+         break;
+   }
+}
+
+/* Variable length integers, with signed values zigzag encoded so that small
+ * deltas of either sign take a single byte */
+static size_t put_varint(uint8_t *p, uint64_t v) {
+   size_t n = 0;
+   while(v >= 0x80) {
+      p[n++] = v | 0x80;
+      v >>= 7;
+   }
+   p[n++] = v;
+   return n;
+}
+
+static int get_varint(const uint8_t *p, size_t len, size_t *pos, uint64_t *v) {
+   int shift = 0;
+   *v = 0;
+   while(*pos < len && shift < 64) {
+      *v |= (uint64_t)(p[*pos] & 0x7f) << shift;
+      if(!(p[(*pos)++] & 0x80))
+         return 0;
+      shift += 7;
+   }
+   return -1;
+}
+
+static uint64_t zigzag(int64_t v) {
+   return ((uint64_t)v << 1) ^ (v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+   return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/* Appends a record to the block as the deltas of its fixed point values with
+ * respect to the previous record of the same kind */
+static void encode_record(struct record *r) {
+   int i;
+   int64_t v;
+
+   if(block_len == 0) {
+      clock_gettime(CLOCK_REALTIME, &block_deadline);
+      block_deadline.tv_sec += BLOCK_FLUSH_INTERVAL;
+   }
+   block_len += put_varint(block+block_len, (uint64_t)r->count << KIND_BITS | r->kind);
+   for(i=0; i<r->count; i++) {
+      v = llround(r->value[i] * (i < column_count ? column_scales[i] : SCALE_MILLI));
+      block_len += put_varint(block+block_len, zigzag(v - previous[r->kind][i]));
+      previous[r->kind][i] = v;
+   }
+}
+
+/* FNV-1a hash of the uncompressed block, to detect corruption */
+static uint32_t checksum(const uint8_t *p, size_t len) {
+   uint32_t h = 2166136261u;
+   while(len--)
+      h = (h ^ *p++) * 16777619u;
+   return h;
+}
+
+/* Writes a literal run and a match in the LZ4 style: a token with both
+ * lengths, extra length bytes, the literals and the offset of the match.
+ * Returns the new output position, or 0 if it does not fit. */
+static size_t lz_length(uint8_t *dst, size_t cap, size_t op, size_t len) {
+   for(len -= 15; ; len -= 255) {
+      if(op >= cap) return 0;
+      dst[op++] = len < 255 ? len : 255;
+      if(len < 255) return op;
+   }
+}
+
+static size_t lz_sequence(uint8_t *dst, size_t cap, size_t op, const uint8_t *lit, size_t lit_len,
+      size_t offset, size_t match_len) {
+   size_t m = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+   if(op >= cap) return 0;
+   dst[op++] = (lit_len < 15 ? lit_len : 15) << 4 | (m < 15 ? m : 15);
+   if(lit_len >= 15 && (op = lz_length(dst, cap, op, lit_len)) == 0) return 0;
+   if(op + lit_len > cap) return 0;
+   memcpy(dst+op, lit, lit_len);
+   op += lit_len;
+   if(match_len) {
+      if(op + 2 > cap) return 0;
+      dst[op++] = offset;
+      dst[op++] = offset >> 8;
+      if(m >= 15 && (op = lz_length(dst, cap, op, m)) == 0) return 0;
+   }
+   return op;
+}
+
+/* Compresses src into dst. Returns the compressed size, or 0 if it is not
+ * smaller than cap. */
+static size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+   static uint32_t table[1 << LZ_HASH_BITS];
+   size_t ip = 0, anchor = 0, op = 0, ref, match;
+   uint32_t seq, h;
+
+   memset(table, 0, sizeof(table));
+   while(ip + LZ_MIN_MATCH <= len) {
+      memcpy(&seq, src+ip, 4);
+      h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+      /* Positions are stored plus one, so that zero means empty */
+      ref = table[h];
+      table[h] = ip + 1;
+      if(ref-- && ip - ref <= LZ_MAX_OFFSET && memcmp(src+ref, src+ip, LZ_MIN_MATCH) == 0) {
+         for(match = LZ_MIN_MATCH; ip + match < len && src[ref+match] == src[ip+match]; match++);
+         if((op = lz_sequence(dst, cap, op, src+anchor, ip-anchor, ip-ref, match)) == 0)
+            return 0;
+         ip += match;
+         anchor = ip;
+      }
+      else
+         ip++;
+   }
+   return lz_sequence(dst, cap, op, src+anchor, len-anchor, 0, 0);
+}
+
+/* Returns the decompressed size, or -1 if src is corrupt */
+static long lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+   size_t ip = 0, op = 0, lit, match, offset;
+   uint8_t token;
+
+   while(ip < len) {
+      token = src[ip++];
+      lit = token >> 4;
+      if(lit == 15)
+         do { if(ip >= len) return -1; lit += src[ip]; } while(src[ip++] == 255);
+      if(ip + lit > len || op + lit > cap) return -1;
+      memcpy(dst+op, src+ip, lit);
+      ip += lit;
+      op += lit;
+      /* The last sequence has only literals */
+      if(ip == len) break;
+      if(ip + 2 > len) return -1;
+      offset = src[ip] | src[ip+1] << 8;
+      ip += 2;
+      match = token & 15;
+      if(match == 15)
+         do { if(ip >= len) return -1; match += src[ip]; } while(src[ip++] == 255);
+      match += LZ_MIN_MATCH;
+      if(offset == 0 || offset > op || op + match > cap) return -1;
+      /* Byte by byte, since the match may overlap with its own output */
+      for(; match; match--, op++)
+         dst[op] = dst[op-offset];
+   }
+   return op;
+}
+
+/* Compresses the current block and writes it with its header. Each block is
+ * self contained, so a truncated file can be read up to its last block. */
+static void flush_block() {
+   static uint8_t packed[BLOCK_HEADER + BLOCK_SIZE];
+   size_t len = 0;
+   int codec = CODEC_RAW;
+
+   if(block_len == 0)
+      return;
+#if ZSTD
+   len = ZSTD_compress(packed+BLOCK_HEADER, BLOCK_SIZE, block, block_len, 3);
+   if(ZSTD_isError(len) || len >= block_len)
+      len = 0;
+   else
+      codec = CODEC_ZSTD;
+#else
+   len = lz_compress(block, block_len, packed+BLOCK_HEADER, block_len - 1);
+   if(len)
+      codec = CODEC_LZ;
+#endif
+   if(codec == CODEC_RAW) {
+      memcpy(packed+BLOCK_HEADER, block, block_len);
+      len = block_len;
+   }
+   memcpy(packed, BLOCK_MAGIC, 4);
+   packed[4] = codec;
+   put_u32(packed+5, block_len);
+   put_u32(packed+9, len);
+   put_u32(packed+13, checksum(block, block_len));
+
+   if(block_count == block_alloc) {
+      block_alloc = block_alloc ? 2*block_alloc : 64;
+      block_offsets = realloc(block_offsets, block_alloc*sizeof(*block_offsets));
+   }
+   if(block_offsets)
+      block_offsets[block_count++] = written;
+   write_out(packed, BLOCK_HEADER + len);
+   fflush(writer_out);
+
+   block_len = 0;
+   memset(previous, 0, sizeof(previous));
+}
+
+/* Writes the offsets of all blocks, followed by the offset of the index
+ * itself so that it can be found from the end of the file */
+static void write_index() {
+   uint8_t buf[8];
+   uint64_t index_offset = written;
+   size_t i;
+
+   write_out(INDEX_MAGIC, 4);
+   put_u32(buf, block_count);
+   write_out(buf, 4);
+   for(i=0; i<block_count; i++) {
+      put_u64(buf, block_offsets[i]);
+      write_out(buf, 8);
+   }
+   put_u64(buf, index_offset);
+   write_out(buf, 8);
+   free(block_offsets);
+   block_offsets = NULL;
+   block_count = block_alloc = 0;
+}
+
+/* Prints the records of an uncompressed block as text */
+static int decode_block(const uint8_t *p, size_t len, const double *scales, int columns, FILE *out) {
+   int64_t prev[RECORD_KINDS][MAX_COLUMNS];
+   struct record r;
+   size_t pos = 0;
+   uint64_t v;
+   int i;
+
+   memset(prev, 0, sizeof(prev));
+   while(pos < len) {
+      if(get_varint(p, len, &pos, &v) < 0)
+         return -1;
+      r.kind = v & (RECORD_KINDS-1);
+      r.count = v >> KIND_BITS;
+      if(r.kind > RECORD_ROI_END || r.count > MAX_COLUMNS)
+         return -1;
+      for(i=0; i<r.count; i++) {
+         if(get_varint(p, len, &pos, &v) < 0)
+            return -1;
+         prev[r.kind][i] += unzigzag(v);
+         r.value[i] = prev[r.kind][i] / (i < columns ? scales[i] : SCALE_MILLI);
+      }
+      print_record(out, &r);
+   }
+   return 0;
+}
+
+/* Reads the block offsets back from the index at the end of the file, if
+ * it is there and intact, leaving the file where it was */
+static void read_index(FILE *in) {
+   uint8_t buf[8];
+   long start = ftell(in);
+   uint32_t i, count;
+
+   if(start < 0 || fseek(in, -8, SEEK_END) != 0 || fread(buf, 1, 8, in) != 8
+         || fseek(in, get_u64(buf), SEEK_SET) != 0
+         || fread(buf, 1, 8, in) != 8 || memcmp(buf, INDEX_MAGIC, 4) != 0
+         || (count = get_u32(buf+4)) == 0
+         || (block_offsets = malloc(count*sizeof(*block_offsets))) == NULL) {
+      fseek(in, start, SEEK_SET);
+      return;
+   }
+   for(i=0; i<count && fread(buf, 1, 8, in) == 8; i++)
+      block_offsets[i] = get_u64(buf);
+   block_count = i;
+   fseek(in, start, SEEK_SET);
+}
+
+/* Moves past a damaged block starting at offset start, to the next block the
+ * index knows of or, without an index, to the next block magic found.
+ * Returns -1 if there is nothing left to decode */
+static int skip_block(FILE *in, long start) {
+   uint8_t window[4];
+   size_t i;
+   int c;
+
+   if(start < 0)
+      return -1;
+   if(block_count) {
+      for(i=0; i<block_count; i++)
+         if(block_offsets[i] > (uint64_t)start)
+            return fseek(in, block_offsets[i], SEEK_SET);
+      return -1;
+   }
+   if(fseek(in, start+1, SEEK_SET) != 0 || fread(window, 1, 4, in) != 4)
+      return -1;
+   while(memcmp(window, BLOCK_MAGIC, 4) != 0 && memcmp(window, INDEX_MAGIC, 4) != 0) {
+      if((c = fgetc(in)) == EOF)
+         return -1;
+      memmove(window, window+1, 3);
+      window[3] = c;
+   }
+   return fseek(in, -4, SEEK_CUR);
+}
+
+int writer_decode(FILE *in, FILE *out) {
+   static uint8_t packed[BLOCK_SIZE];
+   static uint8_t raw[BLOCK_SIZE];
+   uint8_t buf[BLOCK_HEADER];
+   double scales[MAX_COLUMNS];
+   uint32_t raw_len, len;
+   long n = 0, start;
+   int i, c, count, blocks = 0, skipped = 0;
+
+   if(fread(buf, 1, 8, in) != 8 || memcmp(buf, FILE_MAGIC, 8) != 0) {
+      fprintf(stderr,"Error: Not a compressed sauna file.\n");
+      return -1;
+   }
+   if(fread(buf, 1, 4, in) != 4 || (count = get_u32(buf)) > MAX_COLUMNS) {
+      fprintf(stderr,"Error: Corrupt header.\n");
+      return -1;
+   }
+   for(i=0; i<count; i++) {
+      fputs(i ? " " : "", out);
+      while((c = fgetc(in)) != EOF && c != '\0')
+         fputc(c, out);
+      if(fread(buf, 1, 4, in) != 4 || (scales[i] = get_u32(buf)) == 0) {
+         fprintf(stderr,"Error: Corrupt header.\n");
+         return -1;
+      }
+   }
+   fprintf(out,"\n");
+   read_index(in);
+
+   for(;;) {
+      start = ftell(in);
+      if((len = fread(buf, 1, BLOCK_HEADER, in)) == 0)
+         break;
+      if(len >= 4 && memcmp(buf, INDEX_MAGIC, 4) == 0)
+         break;
+      raw_len = get_u32(buf+5);
+      len = len == BLOCK_HEADER ? get_u32(buf+9) : 0;
+      if(len == 0 || memcmp(buf, BLOCK_MAGIC, 4) != 0 || raw_len > BLOCK_SIZE
+            || len > BLOCK_SIZE || fread(packed, 1, len, in) != len)
+         n = -1;
+      else switch(buf[4]) {
+         case CODEC_RAW:
+            memcpy(raw, packed, len);
+            n = len;
+            break;
+         case CODEC_LZ:
+            n = lz_decompress(packed, len, raw, raw_len);
+            break;
+         case CODEC_ZSTD:
+#if ZSTD
+            n = ZSTD_decompress(raw, raw_len, packed, len);
+            if(ZSTD_isError(n)) n = -1;
+            break;
+#else
+            fprintf(stderr,"Error: Block compressed with zstd. Rebuild with ZSTD=1 to decode it.\n");
+            return -1;
+#endif
+         default:
+            n = -1;
+      }
+      if(n != raw_len || checksum(raw, raw_len) != get_u32(buf+13)
+            || decode_block(raw, raw_len, scales, count, out) < 0) {
+         fprintf(stderr,"Warning: Skipping truncated or corrupt block after %d blocks.\n", blocks);
+         skipped++;
+         if(skip_block(in, start) < 0)
+            break;
+         continue;
+      }
+      blocks++;
+   }
+   if(skipped)
+      fprintf(stderr,"Warning: Decoded %d blocks, skipped %d damaged ones.\n", blocks, skipped);
+   free(block_offsets);
+   block_offsets = NULL;
+   block_count = 0;
+   return 0;
+}
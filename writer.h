@@ -0,0 +1,54 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdio.h>
+
+/* Maximum number of columns in a record, including time */
+#define MAX_COLUMNS	64
+
+/* Kinds of records */
+#define RECORD_SAMPLE	0
+#define RECORD_TOTALS	1
+#define RECORD_SUMMARY	2
+#define RECORD_TRIGGER	3
+#define RECORD_ROI_BEGIN	4
+#define RECORD_ROI_END	5
+
+/* Reasons for a trigger record, the second value after time */
+#define TRIGGER_POWER	1
+#define TRIGGER_ROI	2
+#define TRIGGER_SIGNAL	3
+#define TRIGGER_EXIT	4
+
+/* Resolution of a column in the compressed format, as fixed point steps
+ * per unit */
+#define SCALE_MILLI	1000
+#define SCALE_MICRO	1000000
+
+/* Output formats */
+#define FORMAT_TEXT	0
+#define FORMAT_COMPRESSED	1
+#define FORMAT_TRACE	2
+
+/* Adds a column, measured in unit with the given resolution, to the header.
+ * Must be called before writer_start */
+void writer_column(const char *unit, int scale, const char *fmt, ...);
+/* Turns on the flight recorder: samples are kept in memory, with only the
+ * last window of them, and written only as a summary every summary samples.
+ * A trigger record writes the samples kept, and the following window of
+ * samples as they come. Must be called before writer_start */
+int writer_flight(int window, int summary);
+/* Writes the header and starts the writer thread */
+int writer_start(FILE *out, int format);
+/* Fill a record with values and queue it for the writer thread. These are
+ * safe to use from a signal handler, and never block the sampler: if the
+ * queue is full the record is dropped and accounted for. */
+void writer_begin(int kind);
+void writer_value(double value);
+void writer_commit();
+/* Writes the pending records and stops the writer thread */
+void writer_stop();
+/* Converts a file in compressed format back to text */
+int writer_decode(FILE *in, FILE *out);
+
+#endif